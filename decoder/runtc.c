@@ -25,22 +25,48 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <dirent.h>
 #include <glib.h>
-#ifdef __LINUX__
+#ifdef __linux__
 #include <sched.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
 #endif
 
 static int debug = FALSE;
 static int statistics = FALSE;
+static int latency = FALSE;
+static int hw_counters = FALSE;
+static char *profile_report;
+static const char *decoders_dir = DECODERS_DIR;
 static char *coverage_report;
+static char *coverage_engine;
 static struct sr_context *ctx;
+static uint64_t stat_bytes;
+static uint64_t samples_sent;
+static uint64_t chunks_sent;
+static uint64_t stress_chunk;
+static GRand *stress_rand;
+static char *raw_infile;
+static uint64_t raw_samplerate;
+static int raw_unitsize = 1;
+static int realtime = FALSE;
+static unsigned long wall_limit;
+static unsigned long cpu_limit;
+static GSList *limit_outputs;
+static volatile sig_atomic_t pybuf_busy;
+static gint64 pace_start, lag_max, lag_final;
+static GArray *sent_chunks;
+static GHashTable *latencies;
 
 struct channel {
 	char *name;
@@ -59,6 +85,7 @@ struct initial_pin_info {
 
 struct pd {
 	const char *name;
+	int stack;
 	GSList *channels;
 	GSList *options;
 	GSList *initial_pins;
@@ -66,12 +93,63 @@ struct pd {
 
 struct output {
 	const char *pd;
+	int stack;
 	const char *pd_id;
 	int type;
 	const char *class;
 	int class_idx;
 	const char *outfile;
 	int outfd;
+	/* Python output not written yet. */
+	GString *pybuf;
+};
+
+/*
+ * Latency histograms: bin 0 counts zero latencies, bin n counts latencies
+ * in the range [2^(n-1), 2^n).
+ */
+#define LATENCY_BINS 65
+
+/* Python stacks are sampled at this rate (Hz) for the profile. */
+#define PROFILE_HZ 100
+
+/* Raw input is sent to the session in chunks of (at most) this size. */
+#define RAW_CHUNK_SIZE (64 * 1024)
+
+/* Python output is written in blocks of (at least) this size. */
+#define PY_OUTPUT_BLOCK (256 * 1024)
+
+struct latency {
+	char *inst;
+	char *class;
+	uint64_t count;
+	uint64_t samples_max;
+	uint64_t samples_sum;
+	uint64_t samples_hist[LATENCY_BINS];
+	gint64 usec_max;
+	gint64 usec_sum;
+	uint64_t usec_hist[LATENCY_BINS];
+};
+
+/* When the chunk of samples ending at 'end' was sent to the session. */
+struct sent_chunk {
+	uint64_t end;
+	gint64 time;
+};
+
+struct hw_counter {
+	const char *name;
+	uint64_t config;
+	int fd;
+};
+
+struct profile {
+	GSList *pdlist;
+	GThread *thread;
+	gint stop;
+	uint64_t samples;
+	/* Collapsed stack -> number of samples. */
+	GHashTable *stacks;
 };
 
 struct cvg {
@@ -143,17 +221,31 @@ static void usage(const char *msg)
 	if (msg)
 		fprintf(stderr, "%s\n", msg);
 
-	printf("Usage: runtc [-dPpoiOfcS]\n");
+	printf("Usage: runtc [-dnPpoiIsutkOfcCSLHFDAWT]\n");
 	printf("  -d  (enables debug output)\n");
+	printf("  -n  (starts a new decoder stack)\n");
 	printf("  -P <protocol decoder>\n");
 	printf("  -p <channelname=channelnum> (optional)\n");
 	printf("  -o <channeloption=value> (optional)\n");
 	printf("  -N <channelname=initial-pin-value> (optional)\n");
 	printf("  -i <input file>\n");
-	printf("  -O <output-pd:output-type[:output-class]>\n");
-	printf("  -f <output file> (optional)\n");
+	printf("  -I <raw input file, FIFO or '-' for stdin>\n");
+	printf("  -s <samplerate> (raw input)\n");
+	printf("  -u <unitsize> (raw input, at most 65536, optional)\n");
+	printf("  -t  (paces raw input at real-time speed)\n");
+	printf("  -k <max samples>[:<seed>] (sends random-sized chunks, optional)\n");
+	printf("  -O <output-pd:output-type[:output-class]> (per stack, repeatable)\n");
+	printf("  -f <output file> (optional, per output)\n");
 	printf("  -c <coverage report> (optional)\n");
+	printf("  -C <coverage engine: monitoring or coverage> (optional)\n");
 	printf("  -S  (enables statistics)\n");
+	printf("  -L  (enables latency statistics)\n");
+	printf("  -H  (enables hardware performance counters)\n");
+	printf("  -F <profile report> (optional)\n");
+	printf("  -D <decoders directory> (optional)\n");
+	printf("  -A <CPU list> (pins runtc and its threads, optional)\n");
+	printf("  -W <seconds> (wall-clock time limit, optional)\n");
+	printf("  -T <seconds> (CPU time limit, optional)\n");
 	exit(msg ? 1 : 0);
 
 }
@@ -176,6 +268,132 @@ static char *py_str_as_str(const PyObject *py_str)
 	return outstr;
 }
 
+static int latency_bin(uint64_t value)
+{
+	int bin;
+
+	for (bin = 0; value; bin++)
+		value >>= 1;
+
+	return bin;
+}
+
+/*
+ * Account for how far behind the fed samples an annotation arrived: the
+ * number of samples sent to the session beyond the annotation's end, and
+ * the time since the samples up to its end were sent.
+ *
+ * Output callbacks run while the main thread is blocked in
+ * srd_session_send(), with the Python GIL held. So the sent chunk list
+ * doesn't change under us, and callbacks from the decoder threads don't
+ * race each other.
+ */
+static void latency_add(struct srd_proto_data *pdata, const char *class)
+{
+	struct latency *lat;
+	struct sent_chunk *chunk;
+	char *key;
+	uint64_t samples;
+	gint64 usec;
+	guint lo, hi, mid;
+
+	key = g_strdup_printf("%s %s", pdata->pdo->di->inst_id, class);
+	if (!(lat = g_hash_table_lookup(latencies, key))) {
+		lat = g_malloc0(sizeof(struct latency));
+		lat->inst = g_strdup(pdata->pdo->di->inst_id);
+		lat->class = g_strdup(class);
+		g_hash_table_insert(latencies, key, lat);
+	} else {
+		g_free(key);
+	}
+
+	samples = 0;
+	if (samples_sent > pdata->end_sample)
+		samples = samples_sent - pdata->end_sample;
+
+	/* Find the first chunk which contains the annotation's last sample. */
+	lo = 0;
+	hi = sent_chunks->len;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		chunk = &g_array_index(sent_chunks, struct sent_chunk, mid);
+		if (chunk->end < pdata->end_sample)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	usec = 0;
+	if (lo < sent_chunks->len) {
+		chunk = &g_array_index(sent_chunks, struct sent_chunk, lo);
+		usec = g_get_monotonic_time() - chunk->time;
+	}
+
+	lat->count++;
+	lat->samples_sum += samples;
+	if (samples > lat->samples_max)
+		lat->samples_max = samples;
+	lat->samples_hist[latency_bin(samples)]++;
+	lat->usec_sum += usec;
+	if (usec > lat->usec_max)
+		lat->usec_max = usec;
+	lat->usec_hist[latency_bin(usec)]++;
+
+}
+
+static void print_latency_hist(const char *name, const uint64_t *hist)
+{
+	int bin, first;
+
+	printf(" %s=", name);
+	first = TRUE;
+	for (bin = 0; bin < LATENCY_BINS; bin++) {
+		if (!hist[bin])
+			continue;
+		printf("%s%d:%" PRIu64, first ? "" : ",", bin, hist[bin]);
+		first = FALSE;
+	}
+
+}
+
+static gint latency_cmp(gconstpointer a, gconstpointer b)
+{
+	return strcmp(a, b);
+}
+
+/* Machine-readable latency histograms on stdout. */
+static void report_latency(void)
+{
+	struct latency *lat;
+	GList *keys, *l;
+
+	keys = g_list_sort(g_hash_table_get_keys(latencies), latency_cmp);
+	for (l = keys; l; l = l->next) {
+		lat = g_hash_table_lookup(latencies, l->data);
+		printf("latency: inst=%s class=%s count=%" PRIu64
+				" samples_max=%" PRIu64 " samples_mean=%.1f"
+				" usec_max=%" PRId64 " usec_mean=%.1f",
+				lat->inst, lat->class, lat->count, lat->samples_max,
+				(double)lat->samples_sum / lat->count, lat->usec_max,
+				(double)lat->usec_sum / lat->count);
+		print_latency_hist("samples_hist", lat->samples_hist);
+		print_latency_hist("usec_hist", lat->usec_hist);
+		printf("\n");
+	}
+	g_list_free(keys);
+
+}
+
+static void latency_free(void *data)
+{
+	struct latency *lat;
+
+	lat = data;
+	g_free(lat->inst);
+	g_free(lat->class);
+	g_free(lat);
+
+}
+
 /*
  * The following routines are callbacks for libsigrokdecode. They receive
  * output from protocol decoders, optionally dropping data to only forward
@@ -191,19 +409,33 @@ static char *py_str_as_str(const PyObject *py_str)
  * library), and adjust .output files to reflect those names. Or specify
  * instance names in each and every test.conf description (-o inst_id=ID).
  *
- * It's assumed that runtc(1) is used to check stacked decoders, but not
- * multiple stacks in parallel and no stacks with multiple instances of
- * decoders of the same type. When such configurations become desirable,
- * runtc(1) needs to emit the instance name, and test configurations and
- * output expectations need adjustment.
+ * Several independent stacks can run in parallel (-n starts a new one).
+ * Each output is bound to the stack it was specified with, and filtering
+ * is done on the instance name of the selected decoder in that stack. So
+ * the same decoder type may appear in several stacks, while the emitted
+ * lines still carry the decoder class name. Stacks with multiple instances
+ * of decoders of the same type are not supported.
  */
 
+static void flush_py(struct output *op)
+{
+	if (op->pybuf->len && write(op->outfd, op->pybuf->str, op->pybuf->len) == -1)
+		ERR("SRD_OUTPUT_PYTHON callback write failure!");
+	g_string_truncate(op->pybuf, 0);
+
+}
+
+/*
+ * Python output is collected in the output's buffer and written in large
+ * blocks. The repr() is taken right away, as decoders may modify objects
+ * after they were put, and is copied from its UTF-8 buffer as it is.
+ */
 static void srd_cb_py(struct srd_proto_data *pdata, void *cb_data)
 {
 	struct output *op;
 	PyObject *pydata, *pyrepr;
-	GString *out;
-	char *s;
+	const char *s;
+	Py_ssize_t len;
 
 	DBG("Python output from %s", pdata->pdo->di->inst_id);
 	op = cb_data;
@@ -218,19 +450,24 @@ static void srd_cb_py(struct srd_proto_data *pdata, void *cb_data)
 		ERR("Invalid Python object.");
 		return;
 	}
-	s = py_str_as_str(pyrepr);
-	Py_DecRef(pyrepr);
+	if (!(s = PyUnicode_AsUTF8AndSize(pyrepr, &len))) {
+		ERR("Invalid Python object.");
+		Py_DecRef(pyrepr);
+		return;
+	}
 
 	/* Output format for testing is '<ss>-<es> <decoder-id>: <repr>\n'. */
-	out = g_string_sized_new(128);
-	g_string_printf(out, "%" PRIu64 "-%" PRIu64 " %s: %s\n",
+	pybuf_busy = TRUE;
+	g_string_append_printf(op->pybuf, "%" PRIu64 "-%" PRIu64 " %s: ",
 			pdata->start_sample, pdata->end_sample,
-			pdata->pdo->di->decoder->id, s);
-	g_free(s);
-	if (write(op->outfd, out->str, out->len) == -1)
-		ERR("SRD_OUTPUT_PYTHON callback write failure!");
-	DBG("wrote '%s'", out->str);
-	g_string_free(out, TRUE);
+			pdata->pdo->di->decoder->id);
+	g_string_append_len(op->pybuf, s, len);
+	g_string_append_c(op->pybuf, '\n');
+	Py_DecRef(pyrepr);
+
+	if (op->pybuf->len >= PY_OUTPUT_BLOCK)
+		flush_py(op);
+	pybuf_busy = FALSE;
 
 }
 
@@ -320,15 +557,210 @@ static void srd_cb_ann(struct srd_proto_data *pdata, void *cb_data)
 
 }
 
+/*
+ * libsigrokdecode only runs the first callback registered for an output
+ * type, so this one hands the data to all outputs (of all stacks) which
+ * take it. Latency statistics are taken on all annotations.
+ */
+static void srd_cb(struct srd_proto_data *pdata, void *cb_data)
+{
+	struct srd_decoder_inst *di;
+	struct srd_proto_data_annotation *pda;
+	struct output *op;
+	GSList *l;
+	char **dec_ann;
+
+	di = pdata->pdo->di;
+	if (latency && pdata->pdo->output_type == SRD_OUTPUT_ANN) {
+		pda = pdata->data;
+		dec_ann = g_slist_nth_data(di->decoder->annotations, pda->ann_class);
+		latency_add(pdata, dec_ann[0]);
+	}
+
+	for (l = cb_data; l; l = l->next) {
+		op = l->data;
+		if (op->type != pdata->pdo->output_type)
+			continue;
+		switch (op->type) {
+		case SRD_OUTPUT_ANN:
+			srd_cb_ann(pdata, op);
+			break;
+		case SRD_OUTPUT_BINARY:
+			srd_cb_bin(pdata, op);
+			break;
+		case SRD_OUTPUT_PYTHON:
+			srd_cb_py(pdata, op);
+			break;
+		}
+	}
+
+}
+
+/* Send the next chunk of samples to the decoder session. */
+static void send_chunk(struct srd_session *sess, const uint8_t *data,
+		uint64_t length, int unitsize)
+{
+	struct sent_chunk chunk;
+	uint64_t start;
+
+	start = samples_sent;
+	samples_sent += length / unitsize;
+	chunks_sent++;
+	if (latency) {
+		chunk.end = samples_sent;
+		chunk.time = g_get_monotonic_time();
+		g_array_append_val(sent_chunks, chunk);
+	}
+	srd_session_send(sess, start, samples_sent, data, length, unitsize);
+	stat_bytes += length;
+
+}
+
+/*
+ * Send samples as they come from the input, or in the chunk stress mode
+ * re-split into chunks of a random number (1 to stress_chunk) of samples.
+ * Decoders must produce the same output regardless of chunk boundaries.
+ */
+static void send_logic(struct srd_session *sess, const uint8_t *data,
+		uint64_t length, int unitsize)
+{
+	uint64_t num_samples, n;
+
+	if (!stress_chunk) {
+		send_chunk(sess, data, length, unitsize);
+		return;
+	}
+
+	num_samples = length / unitsize;
+	while (num_samples) {
+		n = MIN(MIN(stress_chunk, num_samples), G_MAXINT32 - 1);
+		n = g_rand_int_range(stress_rand, 1, n + 1);
+		send_chunk(sess, data, n * unitsize, unitsize);
+		data += n * unitsize;
+		num_samples -= n;
+	}
+
+}
+
+/*
+ * Send raw input to the session. When pacing at real-time speed, each
+ * chunk is sent no earlier than an analyzer could have acquired its last
+ * sample. Once the session is done with the chunk, the time since then
+ * is how far decoding lags behind the acquisition.
+ */
+static void send_raw(struct srd_session *sess, const uint8_t *data,
+		uint64_t length)
+{
+	gint64 due, now;
+
+	due = pace_start + (samples_sent + length / raw_unitsize)
+		* G_USEC_PER_SEC / raw_samplerate;
+	if (realtime && (now = g_get_monotonic_time()) < due)
+		g_usleep(due - now);
+
+	send_logic(sess, data, length, raw_unitsize);
+
+	if (realtime) {
+		lag_final = g_get_monotonic_time() - due;
+		if (lag_final > lag_max)
+			lag_max = lag_final;
+	}
+
+}
+
+/*
+ * Feed raw samples from a file, FIFO or stdin. Regular files are mapped,
+ * anything else is sent on as it comes in.
+ */
+static int feed_raw(struct srd_session *sess)
+{
+	struct stat st;
+	uint8_t *map, *buf;
+	uint64_t length, offset, chunk_size;
+	size_t fill, n;
+	ssize_t ret;
+	gint64 chunk_usec;
+	int fd;
+
+	if (!strcmp(raw_infile, "-")) {
+		fd = STDIN_FILENO;
+	} else if ((fd = open(raw_infile, O_RDONLY)) == -1) {
+		ERR("Unable to open %s: %s", raw_infile, g_strerror(errno));
+		return FALSE;
+	}
+
+	if (srd_session_metadata_set(sess, SRD_CONF_SAMPLERATE,
+			g_variant_new_uint64(raw_samplerate)) != SRD_OK) {
+		ERR("Setting samplerate failed");
+		return FALSE;
+	}
+	if (srd_session_start(sess) != SRD_OK) {
+		ERR("Session start failed");
+		return FALSE;
+	}
+
+	chunk_size = RAW_CHUNK_SIZE - RAW_CHUNK_SIZE % raw_unitsize;
+	pace_start = g_get_monotonic_time();
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			ERR("Unable to map %s: %s", raw_infile, g_strerror(errno));
+			return FALSE;
+		}
+		length = st.st_size - st.st_size % raw_unitsize;
+		for (offset = 0; offset < length; offset += chunk_size)
+			send_raw(sess, map + offset, MIN(chunk_size, length - offset));
+		munmap(map, st.st_size);
+	} else {
+		buf = g_malloc(chunk_size);
+		fill = 0;
+		while ((ret = read(fd, buf + fill, chunk_size - fill)) != 0) {
+			if (ret == -1) {
+				if (errno == EINTR)
+					continue;
+				ERR("Unable to read %s: %s", raw_infile, g_strerror(errno));
+				g_free(buf);
+				return FALSE;
+			}
+			fill += ret;
+			/* Send all complete samples, keep a partial one. */
+			n = fill - fill % raw_unitsize;
+			if (n) {
+				send_raw(sess, buf, n);
+				memmove(buf, buf + n, fill - n);
+				fill -= n;
+			}
+		}
+		if (fill)
+			DBG("Dropping %zu trailing bytes of a partial sample.", fill);
+		g_free(buf);
+	}
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	/*
+	 * Decoding kept up if it never fell behind by more than a chunk.
+	 * The backlog is the number of samples acquired but not decoded yet.
+	 */
+	if (realtime) {
+		chunk_usec = chunk_size / raw_unitsize * G_USEC_PER_SEC / raw_samplerate;
+		printf("realtime: samplerate=%" PRIu64 " kept_up=%d lag_max=%.6f "
+				"lag_final=%.6f backlog_max=%" PRIu64 "\n",
+				raw_samplerate, lag_max <= chunk_usec,
+				lag_max / 1000000.0, lag_final / 1000000.0,
+				lag_max > 0 ? lag_max * raw_samplerate / G_USEC_PER_SEC : 0);
+	}
+
+	return TRUE;
+}
+
 static void sr_cb(const struct sr_dev_inst *sdi,
 		const struct sr_datafeed_packet *packet, void *cb_data)
 {
-	static int samplecnt = 0;
 	const struct sr_datafeed_logic *logic;
 	struct srd_session *sess;
 	GVariant *gvar;
 	uint64_t samplerate;
-	int num_samples;
 	struct sr_dev_driver *driver;
 
 	sess = cb_data;
@@ -357,12 +789,9 @@ static void sr_cb(const struct sr_dev_inst *sdi,
 		break;
 	case SR_DF_LOGIC:
 		logic = packet->payload;
-		num_samples = logic->length / logic->unitsize;
 		DBG("Received SR_DF_LOGIC (%"PRIu64" bytes, unitsize = %d).",
 			logic->length, logic->unitsize);
-		srd_session_send(sess, samplecnt, samplecnt + num_samples,
-				logic->data, logic->length, logic->unitsize);
-		samplecnt += num_samples;
+		send_logic(sess, logic->data, logic->length, logic->unitsize);
 		break;
 	case SR_DF_END:
 		DBG("Received SR_DF_END");
@@ -371,19 +800,437 @@ static void sr_cb(const struct sr_dev_inst *sdi,
 
 }
 
-static int run_testcase(const char *infile, GSList *pdlist, struct output *op)
+static double tv_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+/*
+ * Machine-readable throughput statistics on stdout. The CPU time
+ * includes the decoder threads which libsigrokdecode runs.
+ */
+static void report_statistics(gint64 wall_start, const struct rusage *ru_start)
+{
+	struct rusage ru;
+	double wall, cpu;
+
+	getrusage(RUSAGE_SELF, &ru);
+	wall = (g_get_monotonic_time() - wall_start) / 1000000.0;
+	cpu = tv_seconds(&ru.ru_utime) - tv_seconds(&ru_start->ru_utime)
+		+ tv_seconds(&ru.ru_stime) - tv_seconds(&ru_start->ru_stime);
+
+	printf("stats: samples=%" PRIu64 " bytes=%" PRIu64 " chunks=%" PRIu64
+			" wall=%.6f cpu=%.6f samples_per_sec=%.0f\n", samples_sent,
+			stat_bytes, chunks_sent, wall, cpu,
+			wall > 0 ? samples_sent / wall : 0);
+}
+
+#ifdef __linux__
+static struct hw_counter counters[] = {
+	{ "instructions", PERF_COUNT_HW_INSTRUCTIONS, -1 },
+	{ "cycles", PERF_COUNT_HW_CPU_CYCLES, -1 },
+	{ "cache_misses", PERF_COUNT_HW_CACHE_MISSES, -1 },
+	{ "branch_misses", PERF_COUNT_HW_BRANCH_MISSES, -1 },
+};
+
+/*
+ * Start counting in user space, for this thread and the decoder threads
+ * it's going to create. Counters the kernel doesn't permit (see
+ * perf_event_paranoid) or the CPU doesn't support are left out.
+ */
+static void counters_start(void)
+{
+	struct perf_event_attr attr;
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(counters); i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = counters[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+				PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		counters[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (counters[i].fd == -1) {
+			DBG("Counter %s not available: %s", counters[i].name,
+					g_strerror(errno));
+			continue;
+		}
+		ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+}
+
+/* Machine-readable counter values on stdout. */
+static void counters_report(void)
+{
+	uint64_t values[3];
+	unsigned int i;
+	int first;
+
+	first = TRUE;
+	for (i = 0; i < G_N_ELEMENTS(counters); i++) {
+		if (counters[i].fd == -1)
+			continue;
+		ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counters[i].fd, values, sizeof(values)) == sizeof(values)) {
+			/* Scale up when the counter had to share the PMU. */
+			if (values[2] && values[2] < values[1])
+				values[0] = (double)values[0] * values[1] / values[2];
+			printf("%s %s=%" PRIu64, first ? "counters:" : "",
+					counters[i].name, values[0]);
+			first = FALSE;
+		}
+		close(counters[i].fd);
+		counters[i].fd = -1;
+	}
+	if (!first)
+		printf("\n");
+
+}
+#else
+static void counters_start(void)
+{
+	DBG("Hardware counters are only supported on Linux.");
+}
+
+static void counters_report(void)
+{
+}
+#endif
+
+/*
+ * Name a Python frame "<pd>/<file>:<function>", if it executes code
+ * of one of the decoders in the stack. Like the coverage report, the
+ * profile is limited to the Python files in the decoders' directories.
+ */
+static char *profile_frame_name(PyObject *py_frame, GSList *pdlist)
+{
+	PyObject *py_code, *py_filename, *py_funcname;
+	GSList *l;
+	struct pd *pd;
+	char *filename, *funcname, *scope, *s, *name;
+
+	if (!(py_code = PyObject_GetAttrString(py_frame, "f_code")))
+		return NULL;
+	py_filename = PyObject_GetAttrString(py_code, "co_filename");
+	py_funcname = PyObject_GetAttrString(py_code, "co_name");
+	Py_DecRef(py_code);
+	if (!py_filename || !py_funcname) {
+		Py_XDECREF(py_filename);
+		Py_XDECREF(py_funcname);
+		return NULL;
+	}
+	filename = py_str_as_str(py_filename);
+	funcname = py_str_as_str(py_funcname);
+	Py_DecRef(py_filename);
+	Py_DecRef(py_funcname);
+
+	name = NULL;
+	for (l = pdlist; l && !name; l = l->next) {
+		pd = l->data;
+		scope = g_strdup_printf("/%s/", pd->name);
+		if ((s = strstr(filename, scope)) && g_str_has_suffix(s, ".py"))
+			name = g_strdup_printf("%s:%s", s + 1, funcname);
+		g_free(scope);
+	}
+	g_free(filename);
+	g_free(funcname);
+
+	return name;
+}
+
+/* Take one sample of the Python stack of every thread. */
+static void profile_sample(struct profile *prof)
+{
+	PyObject *py_func, *py_frames, *py_frame, *py_back, *py_key;
+	Py_ssize_t pos;
+	GSList *names, *l;
+	GString *stack;
+	char *name;
+	guint count;
+
+	if (!(py_func = PySys_GetObject("_current_frames")))
+		return;
+	if (!(py_frames = PyObject_CallObject(py_func, NULL))) {
+		PyErr_Clear();
+		return;
+	}
+
+	pos = 0;
+	while (PyDict_Next(py_frames, &pos, &py_key, &py_frame)) {
+		/* Walk outwards from the innermost frame. */
+		names = NULL;
+		Py_IncRef(py_frame);
+		while (py_frame && py_frame != Py_None) {
+			if ((name = profile_frame_name(py_frame, prof->pdlist)))
+				names = g_slist_prepend(names, name);
+			py_back = PyObject_GetAttrString(py_frame, "f_back");
+			Py_DecRef(py_frame);
+			py_frame = py_back;
+		}
+		Py_XDECREF(py_frame);
+		PyErr_Clear();
+		if (!names)
+			/* Not running decoder code. */
+			continue;
+
+		stack = g_string_sized_new(256);
+		for (l = names; l; l = l->next) {
+			if (l != names)
+				g_string_append_c(stack, ';');
+			g_string_append(stack, l->data);
+		}
+		g_slist_free_full(names, g_free);
+		count = GPOINTER_TO_UINT(g_hash_table_lookup(prof->stacks, stack->str));
+		g_hash_table_insert(prof->stacks, g_string_free(stack, FALSE),
+				GUINT_TO_POINTER(count + 1));
+	}
+	Py_DecRef(py_frames);
+	prof->samples++;
+
+}
+
+/*
+ * Samples are taken in a thread of their own, which needs the GIL to
+ * look at the other threads' frames. So a sample waits at most until
+ * the running decoder thread hands over the GIL, and doesn't interrupt
+ * it in the middle of a bytecode. These are wall-clock samples: time a
+ * decoder spends waiting for input shows up in its wait() call.
+ */
+static gpointer profile_thread(gpointer data)
+{
+	struct profile *prof;
+	PyGILState_STATE gstate;
+
+	prof = data;
+	while (!g_atomic_int_get(&prof->stop)) {
+		g_usleep(G_USEC_PER_SEC / PROFILE_HZ);
+		gstate = PyGILState_Ensure();
+		profile_sample(prof);
+		PyGILState_Release(gstate);
+	}
+
+	return NULL;
+}
+
+static struct profile *profile_start(GSList *pdlist)
+{
+	struct profile *prof;
+
+	DBG("Starting profiler.");
+	prof = g_malloc0(sizeof(struct profile));
+	prof->pdlist = pdlist;
+	prof->stacks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	prof->thread = g_thread_new("profile", profile_thread, prof);
+
+	return prof;
+}
+
+static gint profile_stack_cmp(gconstpointer a, gconstpointer b)
+{
+	return strcmp(a, b);
+}
+
+/* Write the profile in collapsed stack format, for flamegraph tools. */
+static int profile_stop(struct profile *prof)
+{
+	GList *stacks, *l;
+	FILE *f;
+	int ret;
+
+	DBG("Stopping profiler.");
+	g_atomic_int_set(&prof->stop, TRUE);
+	g_thread_join(prof->thread);
+
+	ret = TRUE;
+	if (!(f = fopen(profile_report, "w"))) {
+		ERR("Unable to open %s for writing: %s", profile_report,
+				g_strerror(errno));
+		ret = FALSE;
+	} else {
+		stacks = g_list_sort(g_hash_table_get_keys(prof->stacks),
+				profile_stack_cmp);
+		for (l = stacks; l; l = l->next)
+			fprintf(f, "%s %u\n", (char *)l->data, GPOINTER_TO_UINT(
+					g_hash_table_lookup(prof->stacks, l->data)));
+		g_list_free(stacks);
+		fclose(f);
+		printf("profile: samples=%" PRIu64 " stacks=%u\n", prof->samples,
+				g_hash_table_size(prof->stacks));
+	}
+	g_hash_table_destroy(prof->stacks);
+	g_free(prof);
+
+	return ret;
+}
+
+#ifdef __linux__
+/*
+ * Pin runtc to the CPUs in a list like "0,2-3". This is done before any
+ * other threads exist, the decoder threads which libsigrokdecode creates
+ * inherit the affinity.
+ */
+static int set_affinity(const char *cpulist)
+{
+	cpu_set_t set;
+	char **ranges, *end;
+	unsigned long first, last, cpu;
+	int i;
+
+	CPU_ZERO(&set);
+	ranges = g_strsplit(cpulist, ",", 0);
+	for (i = 0; ranges[i]; i++) {
+		first = last = strtoul(ranges[i], &end, 10);
+		if (end != ranges[i] && *end == '-')
+			last = strtoul(end + 1, &end, 10);
+		if (end == ranges[i] || *end || last < first || last >= CPU_SETSIZE) {
+			ERR("Invalid CPU list '%s'", cpulist);
+			g_strfreev(ranges);
+			return FALSE;
+		}
+		for (cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, &set);
+	}
+	g_strfreev(ranges);
+
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		ERR("Unable to set CPU affinity: %s", g_strerror(errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+#else
+static int set_affinity(const char *cpulist)
+{
+	DBG("Ignoring CPU list '%s', CPU affinity is only supported on Linux.",
+			cpulist);
+
+	return TRUE;
+}
+#endif
+
+/*
+ * Called at a time limit, after faulthandler dumped the Python stacks.
+ * The Python output decoded so far is still written, unless the limit
+ * hit while it was being buffered.
+ */
+static void limit_exit(int sig)
+{
+	struct output *op;
+	GSList *l;
+
+	(void)sig;
+	for (l = limit_outputs; l && !pybuf_busy; l = l->next) {
+		op = l->data;
+		if (op->pybuf && op->pybuf->len &&
+				write(op->outfd, op->pybuf->str, op->pybuf->len) == -1)
+			continue;
+	}
+	_exit(1);
+}
+
+/*
+ * Limit the run's wall-clock and CPU time. A decoder stuck in a loop then
+ * has its Python stack (and those of all other threads) dumped to stderr
+ * by faulthandler before runtc is stopped: SIGALRM at the wall-clock
+ * limit and SIGXCPU at the CPU time limit make it dump the stacks, and
+ * then run limit_exit(). The hard CPU time limit kills runtc a second
+ * later, should that not be reached.
+ */
+static int set_limits(GSList *outputs)
+{
+	PyGILState_STATE gstate;
+	PyObject *py_mod, *py_func, *py_args, *py_kwargs, *py_res;
+	struct sigaction sa;
+	struct rlimit rl;
+	int ret, sigs[2], num_sigs, i;
+
+	limit_outputs = outputs;
+	num_sigs = 0;
+	if (wall_limit)
+		sigs[num_sigs++] = SIGALRM;
+	if (cpu_limit)
+		sigs[num_sigs++] = SIGXCPU;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = limit_exit;
+	sigemptyset(&sa.sa_mask);
+
+	gstate = PyGILState_Ensure();
+	ret = FALSE;
+	py_func = py_kwargs = NULL;
+	if (!(py_mod = PyImport_ImportModule("faulthandler")))
+		goto out;
+
+	/* faulthandler.register(sig, chain=True), chained to limit_exit() */
+	if (!(py_func = PyObject_GetAttrString(py_mod, "register")))
+		goto out;
+	if (!(py_kwargs = Py_BuildValue("{sO}", "chain", Py_True)))
+		goto out;
+	for (i = 0; i < num_sigs; i++) {
+		if (sigaction(sigs[i], &sa, NULL) == -1) {
+			ERR("Unable to set up time limits: %s", g_strerror(errno));
+			goto out;
+		}
+		if (!(py_args = Py_BuildValue("(i)", sigs[i])))
+			goto out;
+		py_res = PyObject_Call(py_func, py_args, py_kwargs);
+		Py_DecRef(py_args);
+		if (!py_res)
+			goto out;
+		Py_DecRef(py_res);
+	}
+
+	if (wall_limit)
+		alarm(wall_limit);
+	if (cpu_limit) {
+		rl.rlim_cur = cpu_limit;
+		rl.rlim_max = cpu_limit + 1;
+		if (setrlimit(RLIMIT_CPU, &rl) == -1) {
+			ERR("Unable to set CPU time limit: %s", g_strerror(errno));
+			goto out;
+		}
+	}
+	ret = TRUE;
+
+out:
+	if (PyErr_Occurred()) {
+		ERR("Unable to set up time limits.");
+		PyErr_PrintEx(0);
+		PyErr_Clear();
+	}
+	Py_XDECREF(py_kwargs);
+	Py_XDECREF(py_func);
+	Py_XDECREF(py_mod);
+	PyGILState_Release(gstate);
+
+	return ret;
+}
+
+static const int output_types[] = {
+	SRD_OUTPUT_ANN, SRD_OUTPUT_BINARY, SRD_OUTPUT_PYTHON,
+};
+
+static int run_testcase(const char *infile, GSList *pdlist, GSList *outputs)
 {
 	struct srd_session *sess;
 	struct srd_decoder *dec;
 	struct srd_decoder_inst *di, *prev_di;
-	srd_pd_output_callback cb;
+	struct output *op;
 	struct pd *pd;
 	struct channel *channel;
 	struct option *option;
 	GVariant *gvar;
 	GHashTable *channels, *opts;
-	GSList *pdl, *l, *l2, *devices;
-	int idx, i;
+	GSList *pdl, *l, *l2, *ol, *devices;
+	int idx, i, prev_stack, raw_ok;
+	unsigned int t;
 	int max_channel;
 	char **decoder_class;
 	struct sr_session *sr_sess;
@@ -391,45 +1238,59 @@ static int run_testcase(const char *infile, GSList *pdlist, struct output *op)
 	const char *s;
 	GArray *initial_pins;
 	struct initial_pin_info *initial_pin;
-
-	if (op->outfile) {
-		if ((op->outfd = open(op->outfile, O_CREAT|O_WRONLY, 0600)) == -1) {
+	struct rusage ru_start;
+	gint64 wall_start;
+	struct profile *prof;
+
+	for (ol = outputs; ol; ol = ol->next) {
+		op = ol->data;
+		if (!op->outfile)
+			continue;
+		if ((op->outfd = open(op->outfile, O_CREAT|O_WRONLY|O_TRUNC, 0600)) == -1) {
 			ERR("Unable to open %s for writing: %s", op->outfile,
 					g_strerror(errno));
 			return FALSE;
 		}
 	}
-
-	if (sr_session_load(ctx, infile, &sr_sess) != SR_OK){
-		ERR("sr_session_load() failed");
-		return FALSE;
+	for (ol = outputs; ol; ol = ol->next) {
+		op = ol->data;
+		if (op->type == SRD_OUTPUT_PYTHON)
+			op->pybuf = g_string_sized_new(2 * PY_OUTPUT_BLOCK);
 	}
 
-	sr_session_dev_list(sr_sess, &devices);
+	sr_sess = NULL;
+	if (infile) {
+		if (sr_session_load(ctx, infile, &sr_sess) != SR_OK){
+			ERR("sr_session_load() failed");
+			return FALSE;
+		}
+		sr_session_dev_list(sr_sess, &devices);
+	}
 
 	if (srd_session_new(&sess) != SRD_OK) {
 		ERR("srd_session_new() failed");
 		return FALSE;
 	}
-	sr_session_datafeed_callback_add(sr_sess, sr_cb, sess);
-	switch (op->type) {
-	case SRD_OUTPUT_ANN:
-		cb = srd_cb_ann;
-		break;
-	case SRD_OUTPUT_BINARY:
-		cb = srd_cb_bin;
-		break;
-	case SRD_OUTPUT_PYTHON:
-		cb = srd_cb_py;
-		break;
-	default:
-		ERR("Invalid op->type");
-		return FALSE;
+	if (sr_sess)
+		sr_session_datafeed_callback_add(sr_sess, sr_cb, sess);
+	for (t = 0; t < G_N_ELEMENTS(output_types); t++) {
+		for (ol = outputs; ol; ol = ol->next) {
+			op = ol->data;
+			if (op->type == output_types[t])
+				break;
+		}
+		if (ol || (latency && output_types[t] == SRD_OUTPUT_ANN))
+			srd_pd_output_callback_add(sess, output_types[t],
+					srd_cb, outputs);
+	}
+	if (latency) {
+		sent_chunks = g_array_new(FALSE, FALSE, sizeof(struct sent_chunk));
+		latencies = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, latency_free);
 	}
-	srd_pd_output_callback_add(sess, op->type, cb, op);
 
 	prev_di = NULL;
-	pd = NULL;
+	prev_stack = 0;
 	for (pdl = pdlist; pdl; pdl = pdl->next) {
 		pd = pdl->data;
 		if (srd_decoder_load(pd->name) != SRD_OK) {
@@ -470,10 +1331,13 @@ static int run_testcase(const char *infile, GSList *pdlist, struct output *op)
 		 * are about to receive PD output from it. We need to
 		 * filter output that carries the decoder instance's name.
 		 */
-		if (strcmp(pd->name, op->pd) == 0) {
+		for (ol = outputs; ol; ol = ol->next) {
+			op = ol->data;
+			if (op->stack != pd->stack || strcmp(pd->name, op->pd))
+				continue;
 			op->pd_id = di->inst_id;
-			DBG("Decoder of type \"%s\" has instance ID \"%s\".",
-			    op->pd, op->pd_id);
+			DBG("Decoder of type \"%s\" in stack %d has instance ID \"%s\".",
+			    op->pd, op->stack, op->pd_id);
 		}
 
 		/* Map channels. */
@@ -522,29 +1386,33 @@ static int run_testcase(const char *infile, GSList *pdlist, struct output *op)
 		}
 
 		/*
-		 * If this is not the first decoder in the list, stack it
+		 * If this is not the first decoder of its stack, stack it
 		 * on top of the previous one.
 		 */
-		if (prev_di) {
+		if (prev_di && prev_stack == pd->stack) {
 			if (srd_inst_stack(sess, prev_di, di) != SRD_OK) {
 				ERR("Failed to stack decoder instances.");
 				return FALSE;
 			}
 		}
 		prev_di = di;
+		prev_stack = pd->stack;
 	}
-	/*
-	 * Bail out if we haven't created an instance of the selected
-	 * decoder type of which we shall grab output data from.
-	 */
-	if (!op->pd_id) {
-		ERR("No / invalid decoder");
-		return FALSE;
-	}
+	for (ol = outputs; ol; ol = ol->next) {
+		op = ol->data;
+		/*
+		 * Bail out if we haven't created an instance of the selected
+		 * decoder type of which we shall grab output data from.
+		 */
+		if (!op->pd_id) {
+			ERR("No / invalid decoder");
+			return FALSE;
+		}
 
-	/* Resolve selected decoder's class index, so we can match. */
-	dec = srd_decoder_get_by_id(pd->name);
-	if (op->class) {
+		/* Resolve selected decoder's class index, so we can match. */
+		if (!op->class)
+			continue;
+		dec = srd_decoder_get_by_id(op->pd);
 		if (op->type == SRD_OUTPUT_ANN)
 			l = dec->annotations;
 		else if (op->type == SRD_OUTPUT_BINARY)
@@ -566,24 +1434,183 @@ static int run_testcase(const char *infile, GSList *pdlist, struct output *op)
 		}
 		if (op->class_idx == -1) {
 			ERR("Output class '%s' not found in decoder %s.",
-					op->class, pd->name);
+					op->class, op->pd);
 			return FALSE;
 		}
 		DBG("Class %s index is %d", op->class, op->class_idx);
 	}
 
-	sr_session_start(sr_sess);
-	sr_session_run(sr_sess);
-	sr_session_stop(sr_sess);
+	wall_start = g_get_monotonic_time();
+	getrusage(RUSAGE_SELF, &ru_start);
+	if (hw_counters)
+		counters_start();
+	prof = NULL;
+	if (profile_report)
+		prof = profile_start(pdlist);
+
+	if (sr_sess) {
+		sr_session_start(sr_sess);
+		sr_session_run(sr_sess);
+		sr_session_stop(sr_sess);
+		raw_ok = TRUE;
+	} else {
+		raw_ok = feed_raw(sess);
+	}
+	/* Also keep what was decoded before a raw input error. */
+	pybuf_busy = TRUE;
+	for (ol = outputs; ol; ol = ol->next) {
+		op = ol->data;
+		if (op->pybuf)
+			flush_py(op);
+	}
+	/* Nothing is left for limit_exit(), the buffers are freed below. */
+	limit_outputs = NULL;
+	pybuf_busy = FALSE;
+	if (!raw_ok)
+		return FALSE;
+
+	if (prof && !profile_stop(prof))
+		return FALSE;
+	if (hw_counters)
+		counters_report();
+	if (statistics)
+		report_statistics(wall_start, &ru_start);
+	if (latency) {
+		report_latency();
+		g_hash_table_destroy(latencies);
+		g_array_free(sent_chunks, TRUE);
+	}
 
 	srd_session_destroy(sess);
 
-	if (op->outfile)
-		close(op->outfd);
+	for (ol = outputs; ol; ol = ol->next) {
+		op = ol->data;
+		if (op->pybuf)
+			g_string_free(op->pybuf, TRUE);
+		if (op->outfile)
+			close(op->outfd);
+	}
 
 	return TRUE;
 }
 
+/*
+ * Line coverage on top of sys.monitoring (Python 3.12+), with the subset
+ * of the coverage.py API used here. Each line event is disabled after its
+ * first hit, so covered code runs at almost full speed, unlike with the
+ * trace function of coverage.py.
+ */
+static const char monitoring_coverage[] =
+	"import sys, fnmatch, ast\n"
+	"mon = sys.monitoring\n"
+	"\n"
+	"class coverage:\n"
+	"    def __init__(self, include):\n"
+	"        self.include = include\n"
+	"        self.lines = {}\n"
+	"        self.skipped = set()\n"
+	"\n"
+	"    def line(self, code, lineno):\n"
+	"        name = code.co_filename\n"
+	"        if name not in self.lines:\n"
+	"            if name in self.skipped:\n"
+	"                return mon.DISABLE\n"
+	"            if not any(fnmatch.fnmatch(name, p) for p in self.include):\n"
+	"                self.skipped.add(name)\n"
+	"                return mon.DISABLE\n"
+	"            self.lines[name] = set()\n"
+	"        self.lines[name].add(lineno)\n"
+	"        return mon.DISABLE\n"
+	"\n"
+	"    def start(self):\n"
+	"        mon.use_tool_id(mon.COVERAGE_ID, 'runtc')\n"
+	"        mon.register_callback(mon.COVERAGE_ID, mon.events.LINE, self.line)\n"
+	"        mon.set_events(mon.COVERAGE_ID, mon.events.LINE)\n"
+	"\n"
+	"    def stop(self):\n"
+	"        mon.set_events(mon.COVERAGE_ID, mon.events.NO_EVENTS)\n"
+	"        mon.register_callback(mon.COVERAGE_ID, mon.events.LINE, None)\n"
+	"        mon.free_tool_id(mon.COVERAGE_ID)\n"
+	"\n"
+	"    def statements(self, filename):\n"
+	"        # Like coverage.py, count the lines having code by the first line\n"
+	"        # of their statement, and leave out docstrings.\n"
+	"        with open(filename, 'rb') as f:\n"
+	"            source = f.read()\n"
+	"        first = {}\n"
+	"        docstrings = set()\n"
+	"        for node in ast.walk(ast.parse(source, filename)):\n"
+	"            if isinstance(node, (ast.Module, ast.ClassDef, ast.FunctionDef,\n"
+	"                    ast.AsyncFunctionDef)) and ast.get_docstring(node, False):\n"
+	"                docstrings.add(node.body[0].lineno)\n"
+	"            heads = getattr(node, 'decorator_list', [])\n"
+	"            if isinstance(node, (ast.stmt, ast.excepthandler)):\n"
+	"                heads = heads + [node]\n"
+	"            elif isinstance(node, ast.match_case):\n"
+	"                heads = [node.pattern]\n"
+	"            # Nested statements come later in the walk and take over\n"
+	"            # their lines from the enclosing one.\n"
+	"            for head in heads:\n"
+	"                for l in range(head.lineno, head.end_lineno + 1):\n"
+	"                    first[l] = head.lineno\n"
+	"        codes = [compile(source, filename, 'exec')]\n"
+	"        lines = set()\n"
+	"        while codes:\n"
+	"            code = codes.pop()\n"
+	"            lines.update(first.get(l, l) for _, _, l in code.co_lines() if l)\n"
+	"            codes.extend(c for c in code.co_consts if hasattr(c, 'co_lines'))\n"
+	"        return lines - docstrings, first\n"
+	"\n"
+	"    def analysis2(self, filename):\n"
+	"        statements, first = self.statements(filename)\n"
+	"        hit = set(first.get(l, l) for l in self.lines.get(filename, ()))\n"
+	"        statements = sorted(statements)\n"
+	"        missing = [l for l in statements if l not in hit]\n"
+	"        return filename, statements, [], missing, ''\n"
+	"\n"
+	"    def report(self, file):\n"
+	"        total = missed = 0\n"
+	"        file.write('%-60s %6s %6s %6s\\n' % ('Name', 'Stmts', 'Miss', 'Cover'))\n"
+	"        for filename in sorted(self.lines):\n"
+	"            _, statements, _, missing, _ = self.analysis2(filename)\n"
+	"            total += len(statements)\n"
+	"            missed += len(missing)\n"
+	"            file.write('%-60s %6d %6d %5.0f%%\\n' % (filename, len(statements),\n"
+	"                len(missing), 100 - 100 * len(missing) / max(len(statements), 1)))\n"
+	"        pct = 100 - 100 * missed / max(total, 1)\n"
+	"        file.write('%-60s %6d %6d %5.0f%%\\n' % ('TOTAL', total, missed, pct))\n"
+	"        return pct\n";
+
+/*
+ * Returns the module providing the coverage class: the sys.monitoring
+ * engine if the interpreter has it, coverage.py otherwise or on request.
+ */
+static PyObject *coverage_module(void)
+{
+	PyObject *py_code, *py_mod;
+	const char *engine;
+
+	engine = coverage_engine;
+	if (!engine)
+		engine = PySys_GetObject("monitoring") ? "monitoring" : "coverage";
+	DBG("Using coverage engine %s.", engine);
+
+	if (!strcmp(engine, "coverage"))
+		return PyImport_ImportModule("coverage");
+	if (strcmp(engine, "monitoring")) {
+		ERR("Unknown coverage engine '%s'.", engine);
+		return NULL;
+	}
+
+	if (!(py_code = Py_CompileString(monitoring_coverage,
+			"runtc_coverage", Py_file_input)))
+		return NULL;
+	py_mod = PyImport_ExecCodeModule("runtc_coverage", py_code);
+	Py_DecRef(py_code);
+
+	return py_mod;
+}
+
 static PyObject *start_coverage(GSList *pdlist)
 {
 	PyObject *py_mod, *py_pdlist, *py_pd, *py_func, *py_args, *py_kwargs, *py_cov;
@@ -592,7 +1619,7 @@ static PyObject *start_coverage(GSList *pdlist)
 
 	DBG("Starting coverage.");
 
-	if (!(py_mod = PyImport_ImportModule("coverage")))
+	if (!(py_mod = coverage_module()))
 		return NULL;
 
 	if (!(py_pdlist = PyList_New(0)))
@@ -725,6 +1752,11 @@ static void cvg_add(struct cvg *dst, const struct cvg *src)
 
 }
 
+static gint pd_name_cmp(gconstpointer a, gconstpointer b)
+{
+	return strcmp(((const struct pd *)a)->name, b);
+}
+
 static int report_coverage(PyObject *py_cov, GSList *pdlist)
 {
 	PyObject *py_func, *py_mod, *py_args, *py_kwargs, *py_outfile, *py_pct;
@@ -739,8 +1771,12 @@ static int report_coverage(PyObject *py_cov, GSList *pdlist)
 	/* Get coverage for each module in the stack. */
 	lines = missed = 0;
 	cvg_all = cvg_new();
-	for (cnt = 0, l = pdlist; l; l = l->next, cnt++) {
+	for (cnt = 0, l = pdlist; l; l = l->next) {
 		pd = l->data;
+		if (g_slist_find_custom(pdlist, pd->name, pd_name_cmp) != l)
+			/* Same decoder in another stack, already reported. */
+			continue;
+		cnt++;
 		if (!(cvg_mod = get_mod_cov(py_cov, pd->name)))
 			return FALSE;
 		printf("coverage: scope=%s coverage=%.0f%% lines=%d missed=%d "
@@ -806,38 +1842,56 @@ static int report_coverage(PyObject *py_cov, GSList *pdlist)
 	return TRUE;
 }
 
+static struct output *new_output(GSList **outputs)
+{
+	struct output *op;
+
+	op = g_malloc0(sizeof(struct output));
+	op->type = -1;
+	op->class_idx = -1;
+	op->outfd = 1;
+	*outputs = g_slist_append(*outputs, op);
+
+	return op;
+}
+
 int main(int argc, char **argv)
 {
 	PyObject *coverage;
+	PyGILState_STATE gstate;
 	GSList *pdlist;
 	struct pd *pd;
 	struct channel *channel;
 	struct option *option;
 	struct output *op;
-	int ret, c;
-	char *opt_infile, **kv, **opstr;
+	GSList *outputs, *l;
+	int ret, c, stack;
+	unsigned long unitsize;
+	guint32 seed;
+	char *opt_infile, **kv, **opstr, *cpulist, *end;
 	struct initial_pin_info *initial_pin;
 
-	op = malloc(sizeof(struct output));
-	op->pd = NULL;
-	op->pd_id = NULL;
-	op->type = -1;
-	op->class = NULL;
-	op->class_idx = -1;
-	op->outfd = 1;
-
+	outputs = NULL;
+	op = NULL;
+	stack = 0;
+	seed = 0;
 	pdlist = NULL;
 	opt_infile = NULL;
+	cpulist = NULL;
 	pd = NULL;
 	coverage = NULL;
-	while ((c = getopt(argc, argv, "dP:p:o:N:i:O:f:c:S")) != -1) {
+	while ((c = getopt(argc, argv, "dnP:p:o:N:i:I:s:u:tk:O:f:c:C:SLHF:D:A:W:T:")) != -1) {
 		switch (c) {
 		case 'd':
 			debug = TRUE;
 			break;
+		case 'n':
+			stack++;
+			break;
 		case 'P':
 			pd = g_malloc(sizeof(struct pd));
 			pd->name = g_strdup(optarg);
+			pd->stack = stack;
 			pd->channels = pd->options = pd->initial_pins = NULL;
 			pdlist = g_slist_append(pdlist, pd);
 			break;
@@ -880,6 +1934,30 @@ int main(int argc, char **argv)
 		case 'i':
 			opt_infile = optarg;
 			break;
+		case 'I':
+			raw_infile = optarg;
+			break;
+		case 's':
+			raw_samplerate = strtoull(optarg, &end, 10);
+			if (end == optarg || *end)
+				raw_samplerate = 0;
+			break;
+		case 'u':
+			/* Whole units are read, one must fit into a chunk. */
+			unitsize = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || unitsize > RAW_CHUNK_SIZE)
+				unitsize = 0;
+			raw_unitsize = unitsize;
+			break;
+		case 't':
+			realtime = TRUE;
+			break;
+		case 'k':
+			kv = g_strsplit(optarg, ":", 0);
+			stress_chunk = strtoull(kv[0], NULL, 10);
+			seed = kv[1] ? strtoul(kv[1], NULL, 10) : g_random_int();
+			g_strfreev(kv);
+			break;
 		case 'O':
 			opstr = g_strsplit(optarg, ":", 0);
 			if (!opstr[0] || !opstr[1]) {
@@ -888,7 +1966,11 @@ int main(int argc, char **argv)
 				g_strfreev(opstr);
 				usage(NULL);
 			}
+			/* An output takes the data of a decoder in this stack. */
+			if (!op || op->pd)
+				op = new_output(&outputs);
 			op->pd = g_strdup(opstr[0]);
+			op->stack = stack;
 			if (!strcmp(opstr[1], "annotation"))
 				op->type = SRD_OUTPUT_ANN;
 			else if (!strcmp(opstr[1], "binary"))
@@ -908,15 +1990,42 @@ int main(int argc, char **argv)
 			g_strfreev(opstr);
 			break;
 		case 'f':
+			/* Applies to the last output, or to the next one. */
+			if (!op || op->outfile)
+				op = new_output(&outputs);
 			op->outfile = g_strdup(optarg);
 			op->outfd = -1;
 			break;
 		case 'c':
 			coverage_report = optarg;
 			break;
+		case 'C':
+			coverage_engine = optarg;
+			break;
 		case 'S':
 			statistics = TRUE;
 			break;
+		case 'L':
+			latency = TRUE;
+			break;
+		case 'H':
+			hw_counters = TRUE;
+			break;
+		case 'F':
+			profile_report = optarg;
+			break;
+		case 'D':
+			decoders_dir = optarg;
+			break;
+		case 'A':
+			cpulist = optarg;
+			break;
+		case 'W':
+			wall_limit = strtoul(optarg, NULL, 10);
+			break;
+		case 'T':
+			cpu_limit = strtoul(optarg, NULL, 10);
+			break;
 		default:
 			usage(NULL);
 		}
@@ -925,20 +2034,41 @@ int main(int argc, char **argv)
 		usage(NULL);
 	if (g_slist_length(pdlist) == 0)
 		usage(NULL);
-	if (!opt_infile)
+	if (!opt_infile == !raw_infile)
 		usage(NULL);
-	if (!op->pd || op->type == -1)
+	if (raw_infile && (!raw_samplerate || raw_unitsize < 1))
+		usage("Raw input needs a samplerate and a valid unitsize.");
+	if (stress_chunk) {
+		/* The seed is reported to reproduce the chunk boundaries. */
+		stress_rand = g_rand_new_with_seed(seed);
+		printf("stress: max_chunk=%" PRIu64 " seed=%" PRIu32 "\n",
+				stress_chunk, seed);
+	}
+	if (!outputs)
 		usage(NULL);
+	for (l = outputs; l; l = l->next) {
+		op = l->data;
+		if (!op->pd || op->type == -1)
+			usage(NULL);
+	}
+
+	if (cpulist && !set_affinity(cpulist))
+		return 1;
 
 	sr_log_callback_set(sr_log, NULL);
 	if (sr_init(&ctx) != SR_OK)
 		return 1;
 
 	srd_log_callback_set(srd_log, NULL);
-	if (srd_init(DECODERS_DIR) != SRD_OK)
+	DBG("Using decoders in %s", decoders_dir);
+	if (srd_init(decoders_dir) != SRD_OK)
+		return 1;
+
+	if ((wall_limit || cpu_limit) && !set_limits(outputs))
 		return 1;
 
 	if (coverage_report) {
+		gstate = PyGILState_Ensure();
 		if (!(coverage = start_coverage(pdlist))) {
 			DBG("Failed to start coverage.");
 			if (PyErr_Occurred()) {
@@ -946,14 +2076,16 @@ int main(int argc, char **argv)
 				PyErr_Clear();
 			}
 		}
+		PyGILState_Release(gstate);
 	}
 
 	ret = 0;
-	if (!run_testcase(opt_infile, pdlist, op))
+	if (!run_testcase(opt_infile, pdlist, outputs))
 		ret = 1;
 
 	if (coverage) {
 		DBG("Stopping coverage.");
+		gstate = PyGILState_Ensure();
 
 		if (!(PyObject_CallMethod(coverage, "stop", NULL)))
 			ERR("Failed to stop coverage.");
@@ -967,6 +2099,7 @@ int main(int argc, char **argv)
 			PyErr_Clear();
 		}
 		Py_DecRef(coverage);
+		PyGILState_Release(gstate);
 	}
 
 	srd_exit();